@@ -0,0 +1,54 @@
+// smallsh embedding API
+//
+// Build smallsh.c with -DSMALLSH_LIBRARY to get a library instead of the
+// CLI (no main, no signal handlers installed):
+//
+//   cc -std=c99 -O2 -fPIC -DSMALLSH_LIBRARY -c smallsh.c -o smallsh.o
+//   ar rcs libsmallsh.a smallsh.o          # static
+//   cc -shared -o libsmallsh.so smallsh.o  # shared
+//
+// A context is a whole shell: job table, last status, foreground-only mode,
+// command hash and parse cache. Its state is thread-local, so a context
+// belongs to the thread that created it and each thread can have one;
+// contexts on different threads run concurrently. What the kernel keeps
+// per process is still shared: the working directory (cd), the
+// environment and stdout/stderr. A for loop sets environment variables, so
+// it must not run while another thread's shell is launching commands.
+//
+// A library context reaps only its own children, by pid or pidfd, and
+// never installs a SIGCHLD handler, so the host keeps its own process
+// handling. There is no job control (fg/bg report "no job control").
+#ifndef SMALLSH_H
+#define SMALLSH_H
+
+typedef struct smallsh_ctx smallsh_ctx_t;
+typedef struct command smallsh_command_t;
+
+// Create the calling thread's context, configured from the SMALLSH_*
+// environment variables like the CLI
+// Returns NULL with errno EBUSY if the thread already has one (or ENOMEM)
+smallsh_ctx_t *smallsh_ctx_new(void);
+
+// Terminate the context's background jobs (as exit does) and free it
+void smallsh_ctx_free(smallsh_ctx_t *ctx);
+
+// Parse one command line (no ; && || or if/while/for) for repeated runs
+// Returns 0 and sets *cmd, 1 for a blank or comment line, -1 on error
+int smallsh_parse(smallsh_ctx_t *ctx, const char *line,
+                  smallsh_command_t **cmd);
+
+// Run a parsed command; it can be run again and must be freed
+// Returns its status as the shell's $? would be (128 + N for signal N)
+int smallsh_run_command(smallsh_ctx_t *ctx, smallsh_command_t *cmd);
+void smallsh_command_free(smallsh_command_t *cmd);
+
+// Parse and run one line, control flow included; finished background jobs
+// are reported first, as before a prompt
+// Returns the status of the last command run, 2 for a syntax error, or -1
+// with errno EINVAL if ctx is not the calling thread's context
+int smallsh_run(smallsh_ctx_t *ctx, const char *line);
+
+// Whether the exit builtin has run; the host decides what to do about it
+int smallsh_exit_requested(const smallsh_ctx_t *ctx);
+
+#endif
@@ -0,0 +1,154 @@
+#!/usr/bin/env bash
+# Smallsh Hot-Path Benchmarks
+# Requires: bash, gcc, coreutils (GNU date for nanosecond timestamps)
+#
+# Usage: tests/bench_smallsh.sh [--save FILE] [--baseline FILE] [source.c]
+#   --save FILE      write the results ("name value unit" lines) to FILE
+#   --baseline FILE  compare against saved results; exit 1 if any metric is
+#                    more than BENCH_TOLERANCE percent worse (default 15)
+#
+# Every metric is the median of BENCH_ROUNDS runs (default 5) so that one
+# noisy run does not move the result.
+
+set -u
+
+# Config
+PROJECT_ROOT="$(cd "$(dirname "$0")"/.. && pwd)"
+DEFAULT_SRC="$PROJECT_ROOT/kiro_smallsh/smallsh.c"
+BUILD_DIR="$PROJECT_ROOT/tests/.build"
+BIN="$BUILD_DIR/smallsh-bench"
+WORKDIR="$PROJECT_ROOT/tests/.work"
+ROUNDS="${BENCH_ROUNDS:-5}"
+TOLERANCE="${BENCH_TOLERANCE:-15}"
+
+mkdir -p "$BUILD_DIR" "$WORKDIR"
+
+# Utilities
+log() { printf "[INFO] %s\n" "$*"; }
+err() { printf "[ERROR] %s\n" "$*"; }
+hr() { printf -- "------------------------------\n"; }
+
+now_ns() { date +%s%N; }
+
+# Median of the numbers given as arguments
+median() {
+  printf "%s\n" "$@" | sort -g | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# Results: parallel arrays of name / value / unit, and whether higher is better
+names=()
+values=()
+units=()
+higher_better=()
+
+record() {
+  names+=("$1"); values+=("$2"); units+=("$3"); higher_better+=("$4")
+  printf "%-22s %12s %s\n" "$1" "$2" "$3"
+}
+
+compile() {
+  local src="$1"
+  if [[ ! -f "$src" ]]; then
+    err "Source not found: $src"
+    exit 2
+  fi
+  log "Compiling: $src"
+  cc -std=c99 -Wall -Wextra -O2 -o "$BIN" "$src"
+}
+
+# 1) Cold start: exec the shell, run nothing, exit
+bench_cold_start() {
+  local starts=200 samples=() r i t0 t1
+  for ((r = 0; r < ROUNDS; r++)); do
+    t0=$(now_ns)
+    for ((i = 0; i < starts; i++)); do
+      "$BIN" -c "" >/dev/null
+    done
+    t1=$(now_ns)
+    samples+=("$(awk -v ns=$((t1 - t0)) -v n=$starts 'BEGIN { printf "%.1f", ns / n / 1000 }')")
+  done
+  record "cold_start" "$(median "${samples[@]}")" "us/start" 0
+}
+
+# 2) Foreground commands through the whole read/parse/launch/wait loop
+bench_true_rate() {
+  local cmds=2000 samples=() r t0 t1
+  local script="$WORKDIR/bench_true.smallsh"
+  yes /bin/true | head -n "$cmds" > "$script"
+  for ((r = 0; r < ROUNDS; r++)); do
+    t0=$(now_ns)
+    "$BIN" "$script" >/dev/null
+    t1=$(now_ns)
+    samples+=("$(awk -v ns=$((t1 - t0)) -v n=$cmds 'BEGIN { printf "%.0f", n / (ns / 1e9) }')")
+  done
+  record "true_commands" "$(median "${samples[@]}")" "commands/sec" 1
+}
+
+# 3) and 4) In-process benchmarks; the value is the second field of the
+# result line the shell prints
+bench_builtin() {
+  local name="$1" unit="$2" samples=() r; shift 2
+  for ((r = 0; r < ROUNDS; r++)); do
+    samples+=("$("$BIN" "$@" | awk 'NR == 2 { print $2 }')")
+  done
+  record "$name" "$(median "${samples[@]}")" "$unit" 1
+}
+
+# Compare against a saved run; returns 1 on any regression past TOLERANCE
+compare_baseline() {
+  local file="$1" regressions=0 i base change
+  hr
+  log "Baseline: $file (tolerance ${TOLERANCE}%)"
+  for ((i = 0; i < ${#names[@]}; i++)); do
+    base=$(awk -v n="${names[i]}" '$1 == n { print $2 }' "$file")
+    if [[ -z "$base" ]]; then
+      log "${names[i]}: no baseline value"
+      continue
+    fi
+    # Positive change = worse, in percent
+    change=$(awk -v b="$base" -v v="${values[i]}" -v h="${higher_better[i]}" \
+      'BEGIN { c = (h == 1) ? (b - v) / b * 100 : (v - b) / b * 100; printf "%.1f", c }')
+    if awk -v c="$change" -v t="$TOLERANCE" 'BEGIN { exit !(c > t) }'; then
+      err "REGRESSION ${names[i]}: ${values[i]} vs $base ${units[i]} (${change}% worse)"
+      regressions=$((regressions+1))
+    else
+      log "ok ${names[i]}: ${values[i]} vs $base ${units[i]}"
+    fi
+  done
+  [[ $regressions -eq 0 ]]
+}
+
+main() {
+  local src="$DEFAULT_SRC" save="" baseline=""
+  while (( "$#" )); do
+    case "$1" in
+      --save) save="$2"; shift 2 ;;
+      --baseline) baseline="$2"; shift 2 ;;
+      *) src="$1"; shift ;;
+    esac
+  done
+
+  compile "$src"
+  hr
+  log "Median of $ROUNDS rounds"
+  bench_cold_start
+  bench_true_rate
+  bench_builtin "parse_max_line" "lines/sec" --bench-parse 30000
+  bench_builtin "background_1k_jobs" "jobs/sec" --bench-jobs 1000
+
+  if [[ -n "$save" ]]; then
+    local i
+    : > "$save"
+    for ((i = 0; i < ${#names[@]}; i++)); do
+      printf "%s %s %s\n" "${names[i]}" "${values[i]}" "${units[i]}" >> "$save"
+    done
+    log "Saved results to $save"
+  fi
+
+  if [[ -n "$baseline" ]]; then
+    compare_baseline "$baseline" || exit 1
+  fi
+  exit 0
+}
+
+main "$@"
@@ -0,0 +1,118 @@
+// Embedding test for the library build (see kiro_smallsh/smallsh.h)
+// Two threads each run their own shell; the host's own child must survive
+// both untouched. Prints "embed: ok" and exits 0 when every check passes.
+//
+//   cc -std=c99 -pthread -DSMALLSH_LIBRARY -Ikiro_smallsh
+//      tests/embed_smallsh.c kiro_smallsh/smallsh.c
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smallsh.h"
+
+#define CHECK(cond)                                                       \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      fprintf(stderr, "embed: check failed at line %d: %s\n", __LINE__,    \
+              #cond);                                                     \
+      return (void *)1;                                                   \
+    }                                                                     \
+  } while (0)
+
+static void *run_shell(void *arg) {
+  long id = (long)arg;
+  smallsh_ctx_t *ctx = smallsh_ctx_new();
+  CHECK(ctx != NULL);
+
+  // One context per thread
+  CHECK(smallsh_ctx_new() == NULL && errno == EBUSY);
+
+  CHECK(smallsh_run(ctx, "true") == 0);
+  CHECK(smallsh_run(ctx, "false") == 1);
+  CHECK(smallsh_run(ctx, "ls /nonexistent-embed 2> /dev/null") == 2);
+  CHECK(smallsh_run(ctx, "true && false") == 1);
+  CHECK(smallsh_run(ctx, "false || ls /nonexistent-embed 2> /dev/null") == 2);
+  CHECK(smallsh_run(ctx, "if true; then") == 2); // Nothing can follow
+  CHECK(smallsh_run(ctx, "sleep 0.2 &") == 0);
+
+  // A parsed command can be run over and over
+  smallsh_command_t *cmd;
+  CHECK(smallsh_parse(ctx, "test -d /nonexistent-embed", &cmd) == 0);
+  for (int i = 0; i < 20; i++) {
+    CHECK(smallsh_run_command(ctx, cmd) == 1);
+  }
+  smallsh_command_free(cmd);
+  CHECK(smallsh_parse(ctx, "ls / > /dev/null", &cmd) == 0);
+  for (int i = 0; i < 20; i++) {
+    CHECK(smallsh_run_command(ctx, cmd) == 0);
+  }
+  smallsh_command_free(cmd);
+  CHECK(smallsh_parse(ctx, "# comment", &cmd) == 1);
+
+  // exit ends the script but not the host
+  CHECK(!smallsh_exit_requested(ctx));
+  CHECK(smallsh_run(ctx, "true; exit; echo not-reached") == 0);
+  CHECK(smallsh_exit_requested(ctx));
+
+  smallsh_ctx_free(ctx);
+
+  // The thread can start over with a fresh context
+  ctx = smallsh_ctx_new();
+  CHECK(ctx != NULL && !smallsh_exit_requested(ctx));
+  CHECK(smallsh_run(ctx, "false") == 1);
+  smallsh_ctx_free(ctx);
+
+  printf("thread %ld ok\n", id);
+  fflush(stdout);
+  return NULL;
+}
+
+int main(void) {
+  // A child of the host, still unreaped while the shells run
+  pid_t host_child = fork();
+  if (host_child == 0) {
+    struct timespec pause = {0, 100000000L};
+    nanosleep(&pause, NULL);
+    _exit(7);
+  }
+
+  // for sets environment variables, which are process-wide: run it here,
+  // before the threads start
+  smallsh_ctx_t *ctx = smallsh_ctx_new();
+  const char *loop = "for i in 1 2 3; do test $i = 3 && exit; done";
+  if (!ctx || smallsh_run(ctx, loop) != 0 || !smallsh_exit_requested(ctx)) {
+    fprintf(stderr, "embed: for loop failed\n");
+    return 1;
+  }
+  smallsh_ctx_free(ctx);
+
+  pthread_t threads[2];
+  for (long i = 0; i < 2; i++) {
+    pthread_create(&threads[i], NULL, run_shell, (void *)i);
+  }
+  int failed = 0;
+  for (int i = 0; i < 2; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    failed |= (result != NULL);
+  }
+
+  int status;
+  if (waitpid(host_child, &status, 0) != host_child || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 7) {
+    fprintf(stderr, "embed: host child was reaped by a shell\n");
+    failed = 1;
+  }
+
+  if (failed) {
+    return 1;
+  }
+  printf("embed: ok\n");
+  return 0;
+}
@@ -7,7 +7,7 @@ set -u
 
 # Config
 PROJECT_ROOT="$(cd "$(dirname "$0")"/.. && pwd)"
-DEFAULT_SRC="$PROJECT_ROOT/attempt_1/smallsh.c"
+DEFAULT_SRC="$PROJECT_ROOT/kiro_smallsh/smallsh.c"
 BUILD_DIR="$PROJECT_ROOT/tests/.build"
 BIN="$BUILD_DIR/smallsh"
 WORKDIR="$PROJECT_ROOT/tests/.work"
@@ -20,15 +20,17 @@ mkdir -p "$BUILD_DIR" "$WORKDIR"
 log() { printf "[INFO] %s\n" "$*"; }
 warn() { printf "[WARN] %s\n" "$*"; }
 err() { printf "[ERROR] %s\n" "$*"; }
-hr() { printf "------------------------------\n"; }
+hr() { printf -- "------------------------------\n"; }
 
 run_with_input() {
   # Usage: run_with_input "input_text" [extra-args...]
+  # VAR=value entries in the caller's run_env array go to the shell only
   local input="$1"; shift || true
+  local -a launch=(env ${run_env[@]+"${run_env[@]}"} "$BIN" "$@")
   if [[ -n "$TIMEOUT_BIN" ]]; then
-    printf "%s" "$input" | "$TIMEOUT_BIN" "$TIME_LIMIT" "$BIN" "$@" 2>&1
+    printf "%s" "$input" | "$TIMEOUT_BIN" "$TIME_LIMIT" "${launch[@]}" 2>&1
   else
-    printf "%s" "$input" | "$BIN" "$@" 2>&1
+    printf "%s" "$input" | "${launch[@]}" 2>&1
   fi
 }
 
@@ -41,6 +43,10 @@ test_case() {
   local input="$1"; shift
   local -a expect_contains=()
   local -a expect_absent=()
+  local -a expect_counts=()
+  local -a extra_args=()
+  local -a run_env=()
+  local -a expect_order=()
   local rc_expect=""
 
   # parse flags
@@ -48,7 +54,11 @@ test_case() {
     case "$1" in
       --expect) expect_contains+=("$2"); shift 2 ;;
       --absent) expect_absent+=("$2"); shift 2 ;;
+      --count) expect_counts+=("$2" "$3"); shift 3 ;;
       --rc) rc_expect="$2"; shift 2 ;;
+      --arg) extra_args+=("$2"); shift 2 ;;
+      --env) run_env+=("$2"); shift 2 ;;
+      --before) expect_order+=("$2" "$3"); shift 3 ;;
       *) err "Unknown flag in test '$name': $1"; return 2 ;;
     esac
   done
@@ -57,7 +67,7 @@ test_case() {
   log "TEST: $name"
   local out
   set +e
-  out=$(run_with_input "$input")
+  out=$(run_with_input "$input" ${extra_args[@]+"${extra_args[@]}"})
   local rc=$?
   set -e
 
@@ -79,6 +89,30 @@ test_case() {
     fi
   done
 
+  # Check exact occurrence counts (pairs of count, substring)
+  local i
+  for ((i = 0; i < ${#expect_counts[@]}; i += 2)); do
+    local want="${expect_counts[i]}" s="${expect_counts[i+1]}"
+    local got
+    got=$(grep -Fc -- "$s" <<<"$out" || true)
+    if [[ "$got" -ne "$want" ]]; then
+      ok=0
+      err "Expected $want lines containing '$s', got $got"
+    fi
+  done
+
+  # Check ordering (pairs of earlier, later substrings)
+  for ((i = 0; i < ${#expect_order[@]}; i += 2)); do
+    local first="${expect_order[i]}" second="${expect_order[i+1]}"
+    local first_line second_line
+    first_line=$(grep -Fn -- "$first" <<<"$out" | head -n1 | cut -d: -f1)
+    second_line=$(grep -Fn -- "$second" <<<"$out" | head -n1 | cut -d: -f1)
+    if [[ -z "$first_line" || -z "$second_line" || "$first_line" -ge "$second_line" ]]; then
+      ok=0
+      err "Expected '$first' before '$second'"
+    fi
+  done
+
   # Check return code (if specified)
   if [[ -n "$rc_expect" ]]; then
     if [[ "$rc" -ne "$rc_expect" ]]; then
@@ -146,7 +180,135 @@ main() {
   test_case "builtin_exit" $'exit\n' --rc 0
 
   # 6) Exec external command
-  test_case "exec_echo" $'echo hello\nexit\n' --expect "hello"
+  test_case "exec_echo" $'/bin/echo hello\nexit\n' --expect "hello"
+
+  # 6a2) echo, true, false, test/[ and printf run inside the shell (they
+  # work with an empty PATH) and honour < and >
+  test_case "builtin_utilities" \
+    $'echo -n a\necho b\nprintf [%s:%03d]\\n x 7\ntest 2 -gt 1\nstatus\n[ -d / ]\nstatus\n[ a = b ]\nstatus\nfalse\nstatus\nexit\n' \
+    --env PATH=/nonexistent \
+    --expect "a: b" \
+    --expect "[x:007]" \
+    --count 2 "exit value 0" \
+    --count 2 "exit value 1" \
+    --absent "exec failed"
+  test_case "builtin_redirection" \
+    $'echo to-file > '"$WORKDIR/builtin_out.txt"$'\ncat '"$WORKDIR/builtin_out.txt"$'\necho x > /no/such/dir/f\nstatus\necho still-stdout\nexit\n' \
+    --expect "to-file" \
+    --expect "Output redirection failed" \
+    --expect "exit value 1" \
+    --expect "still-stdout"
+  test_case "builtin_test_errors" $'[ 1 = 1\nstatus\ntest x -eq 1\nstatus\nexit\n' \
+    --expect "[: missing ]" \
+    --expect "integer expression expected" \
+    --count 2 "exit value 2"
+
+  # 6a3) $$, $VAR and ${VAR} are expanded before the line is split
+  test_case "variable_expansion" \
+    $'echo [$SMALLSH_VAR] [${SMALLSH_VAR}x] [$SMALLSH_UNSET_XYZ] [$] [${SMALLSH_VAR]\necho pid=$$\nexit\n' \
+    --env SMALLSH_VAR=bar \
+    --expect "[bar] [barx] [] [\$] [\${SMALLSH_VAR]" \
+    --expect "pid=" \
+    --absent "pid=\$\$"
+
+  # 6a4) Repeated lines come from the parse cache; cache shows the counts
+  test_case "parse_cache_builtin" $'true\ntrue\ntrue\ncache\ncache -r\ncache\nexit\n' \
+    --expect "2 hits, 2 misses" \
+    --expect "parse cache: 1/"
+
+  # 6a4b) History is appended to SMALLSH_HISTFILE and recalled with !
+  rm -f "$WORKDIR/history"
+  test_case "history_recall" \
+    $'echo first-entry\necho second-entry\n echo not-kept\n!echo f\n!!\n!1\n!nothing\nhistory -n 3 first\nexit\n' \
+    --env SMALLSH_HISTFILE="$WORKDIR/history" \
+    --count 3 ": echo first-entry" \
+    --expect "event not found" \
+    --expect "    1  echo first-entry" \
+    --expect "    3  echo first-entry"
+  test_case "history_persists" $'history\nexit\n' \
+    --env SMALLSH_HISTFILE="$WORKDIR/history" \
+    --expect "    2  echo second-entry" \
+    --expect "    5  exit" \
+    --absent "not-kept"
+  # Truncating the file mid-session re-indexes it instead of faulting
+  rm -f "$WORKDIR/history_trunc"
+  test_case "history_truncated" \
+    $'echo before-trunc\nhistory -n 2\ncat < /dev/null > '"$WORKDIR/history_trunc"$' ; history -n 2\necho after-trunc\n!!\nexit\n' \
+    --env SMALLSH_HISTFILE="$WORKDIR/history_trunc" \
+    --count 3 "after-trunc" \
+    --rc 0
+
+  # 6a5) ; && || and if/while/for run in the shell; open constructs read on
+  test_case "control_flow_operators" \
+    $'true && echo and-ran\nfalse && echo and-skipped\nfalse || echo or-ran ; echo seq-ran\nls /no/such/dir || echo failed-cmd\nexit\n' \
+    --expect "and-ran" \
+    --absent "and-skipped" \
+    --expect "or-ran" \
+    --expect "seq-ran" \
+    --expect "failed-cmd"
+  test_case "control_flow_loops" \
+    $'for i in a b c; do echo item-$i; done\nfor x in 1 2\ndo\n  if test $x = 2; then echo two; else echo not-two; fi\ndone\nwhile test ! -e '"$WORKDIR/loop_flag"$'; do touch '"$WORKDIR/loop_flag"$'; echo looped; done\nexit\n' \
+    --expect "item-a" \
+    --expect "item-c" \
+    --expect "not-two" \
+    --expect "two" \
+    --count 1 "looped"
+  test_case "control_flow_syntax" $'fi\nif true; then echo x; fi &\necho after\nexit\n' \
+    --expect "syntax error near 'fi'" \
+    --expect "syntax error near '&'" \
+    --expect "after"
+
+  # 6a6) >> appends, >! writes a large output, 2> / 2>> / 2>&1 move stderr
+  test_case "redirection_modes" \
+    "cd $WORKDIR"$'\necho one > out.txt\n/bin/echo two >> out.txt\necho three >> out.txt\ncat out.txt\nls /no/such/dir 2> err.txt\nls /no/such/dir 2>> err.txt\nwc -l < err.txt\nls /no/such/dir > both.txt 2>&1\ncat < both.txt\nseq 1 5 >! large.txt\ncat < large.txt >! large2.txt\ncat large2.txt\nexit\n' \
+    --expect "one" \
+    --expect "two" \
+    --expect "three" \
+    --expect ": 2" \
+    --count 1 "cannot access" \
+    --expect "5"
+  test_case "builtin_error_redirection" \
+    "cd $WORKDIR"$'\ntest 1 -eq x 2> terr.txt\nstatus\ncat terr.txt\ntest 1 -eq y 2>&1 | cat\nexit\n' \
+    --expect "exit value 2" \
+    --count 2 "test: "
+
+  # 6b) Unknown command and unreadable input file fail with status 1
+  test_case "exec_not_found" $'no_such_command_xyz\nstatus\nexit\n' \
+    --expect "exec failed" \
+    --expect "exit value 1"
+  test_case "redirection_missing_input" $'cat < /no/such/file\nstatus\nexit\n' \
+    --expect "Input redirection failed" \
+    --expect "exit value 1"
+
+  # 6c) The fork/exec fallback path behaves the same as posix_spawn
+  test_case "exec_fork_path" \
+    $'/bin/echo hello\nno_such_command_xyz\nstatus\nexit\n' \
+    --env SMALLSH_LAUNCH=fork \
+    --expect "hello" \
+    --expect "exec failed" \
+    --expect "exit value 1"
+
+  # 6d) Command hash: lookups are remembered, hash -r clears them, and a
+  # PATH change invalidates them
+  test_case "builtin_hash" $'hash\nuname\nuname\nhash\nhash -r\nhash\nhash no_such_command_xyz\nexit\n' \
+    --expect "hash table empty" \
+    --expect "hits" \
+    --expect "/uname" \
+    --count 2 "hash table empty" \
+    --expect "hash: no_such_command_xyz: not found"
+
+  # 6e) A hashed command that disappears is looked up on PATH again
+  mkdir -p "$WORKDIR/bin1" "$WORKDIR/bin2"
+  printf '#!/bin/sh\necho from-bin1\n' > "$WORKDIR/bin1/hashtool"
+  printf '#!/bin/sh\necho from-bin2\n' > "$WORKDIR/bin2/hashtool"
+  chmod +x "$WORKDIR/bin1/hashtool" "$WORKDIR/bin2/hashtool"
+  test_case "hash_stale_entry" \
+    $'hashtool\nrm '"$WORKDIR/bin1/hashtool"$'\nhashtool\nhash\nexit\n' \
+    --env "PATH=$WORKDIR/bin1:$WORKDIR/bin2:$PATH" \
+    --expect "from-bin1" \
+    --expect "from-bin2" \
+    --expect "bin2/hashtool" \
+    --absent "exec failed"
 
   # 7) Output redirection: echo -> file, then read it back
   (
@@ -159,11 +321,360 @@ main() {
     fi
   )
 
+  # 7a) Plain "cat < a > b" is copied inside the shell: it works even with no
+  # cat on PATH, to a file or to stdout, and reports a missing input file
+  printf 'fast copy payload\n' > "$WORKDIR/copy_src.txt"
+  test_case "fast_copy_in_shell" \
+    $'cat < '"$WORKDIR/copy_src.txt"$' > '"$WORKDIR/copy_dst.txt"$'\nstatus\ncat < '"$WORKDIR/copy_dst.txt"$'\ncat < /no/such/file\nstatus\nexit\n' \
+    --env PATH=/nonexistent \
+    --expect "exit value 0" \
+    --expect "fast copy payload" \
+    --expect "Input redirection failed" \
+    --expect "exit value 1" \
+    --absent "exec failed"
+  test_case "fast_copy_disabled" \
+    $'cat < '"$WORKDIR/copy_src.txt"$'\nexit\n' \
+    --env SMALLSH_FASTCOPY=0 --env PATH=/nonexistent \
+    --expect "exec failed"
+
+  # 7b) Pipelines run natively; status reports the last stage and lists
+  # every stage
+  test_case "pipeline_basic" $'echo hello pipe | tr a-z A-Z\nexit\n' \
+    --expect "HELLO PIPE"
+  test_case "pipeline_status" $'true | false\nstatus\nfalse | true\nstatus\nexit\n' \
+    --expect "exit value 1" \
+    --expect "pipeline: exit value 0 | exit value 1" \
+    --expect "pipeline: exit value 1 | exit value 0"
+  test_case "pipeline_early_exit" $'yes | head -2 | wc -l\nexit\n' \
+    --expect "2"
+  test_case "pipeline_fork_path" \
+    $'echo forked pipe | tr a-z A-Z | cat\nexit\n' \
+    --env SMALLSH_LAUNCH=fork \
+    --expect "FORKED PIPE"
+  test_case "pipeline_missing_stage" $'echo a | | wc\nexit\n' \
+    --expect "Missing command in pipeline"
+
   # 8) Foreground/background: background returns promptly with prompt shown
   test_case "background_ampersand" $'sleep 1 &\necho done\nexit\n' \
     --expect ":" \
     --expect "done"
 
+  # 8b) Background job table: more than 100 jobs in one session are all
+  # tracked and reaped (slots are reused, no lifetime cap)
+  local many_bg
+  many_bg=$(printf 'true &\n%.0s' {1..150})
+  test_case "background_job_table_reuse" "${many_bg}"$'\nsleep 1\nexit\n' \
+    --count 150 "is done: exit value 0" \
+    --absent "Warning"
+
+  # 8b2) Batch modes: -c and script files run without prompt or banners and
+  # exit with the last foreground status; piped stdin drops the banners
+  test_case "batch_dash_c" "" --arg -c --arg $'echo batch-c\nfalse' \
+    --expect "batch-c" \
+    --absent ":" \
+    --absent "smallsh shell" \
+    --rc 1
+  printf 'echo from-script\nstatus\n' > "$WORKDIR/script.smallsh"
+  test_case "batch_script_file" "" --arg "$WORKDIR/script.smallsh" \
+    --expect "from-script" \
+    --expect "exit value 0" \
+    --absent ":" \
+    --rc 0
+  # A child that fails before exec must not rewind the script (fork path)
+  printf 'limit -n 100\necho one\nnosuchcmd_xyz\nls / > /no/such/dir/f\necho two\n' \
+    > "$WORKDIR/fork_fail.smallsh"
+  test_case "script_child_failure" "" --arg "$WORKDIR/fork_fail.smallsh" \
+    --count 1 "one" \
+    --count 1 "two" \
+    --count 1 "exec failed" \
+    --count 1 "Output redirection failed"
+  test_case "batch_missing_script" "" --arg "$WORKDIR/no_such_script" \
+    --expect "no_such_script" \
+    --rc 1
+  test_case "piped_stdin_no_banners" $'echo piped\nexit\n' \
+    --expect "piped" \
+    --absent "smallsh shell starting" \
+    --absent "Signal handlers set up"
+
+  # 8c) Background completion is reported while a foreground job runs
+  printf 'sleep 1\necho fg-finished\n' > "$WORKDIR/slow_fg.sh"
+  test_case "background_done_during_foreground" \
+    $'sleep 0.2 &\nsh '"$WORKDIR/slow_fg.sh"$'\nexit\n' \
+    --before "is done: exit value 0" "fg-finished"
+
+  # 8c2) Resource accounting: time prefix, status -v, and done lines
+  test_case "time_prefix" $'time sleep 0.1\nexit\n' \
+    --expect "real 0.1" \
+    --expect "maxrss" \
+    --absent "exec failed"
+  test_case "status_verbose" $'status -v\nhead -c 1000000 /dev/zero | wc -c\nstatus -v\nexit\n' \
+    --expect "no foreground job has finished yet" \
+    --expect "resources: real" \
+    --expect "ctxsw"
+  test_case "background_done_usage" \
+    $'sleep 0.1 &\nsh '"$WORKDIR/slow_fg.sh"$'\nexit\n' \
+    --expect "is done: exit value 0 (real 0.1"
+
+  # 8c3) SMALLSH_TRACE logs launch and exit events as JSON lines
+  rm -f "$WORKDIR/trace.jsonl"
+  test_case "trace_log" $'/bin/echo traced\ncat '"$WORKDIR/trace.jsonl"$'\nexit\n' \
+    --env "SMALLSH_TRACE=$WORKDIR/trace.jsonl" \
+    --expect '"ev":"line"' \
+    --expect '"ev":"parse_end","pid":0,"cmd":"/bin/echo"' \
+    --expect '"ev":"exec"' \
+    --expect '"ev":"reap"'
+
+  # 8d) Job table builtins; fg/bg need a terminal for job control
+  test_case "jobs_lists_background" $'sleep 1 | cat &\njobs\nexit\n' \
+    --expect "[1]  Running" \
+    --expect "sleep 1 | cat"
+  test_case "fg_without_job_control" $'fg\nexit\n' \
+    --expect "fg: no job control"
+
+  # 8d2) Exit signals every job at once and waits one grace period in all
+  hr
+  log "TEST: exit_cleanup_bounded"
+  local many_jobs="" start_ns elapsed_ms cleanup_out
+  for ((i = 0; i < 50; i++)); do many_jobs+=$'sleep 30 &\n'; done
+  start_ns=$(date +%s%N)
+  cleanup_out=$(run_with_input "${many_jobs}exit"$'\n')
+  elapsed_ms=$(( ($(date +%s%N) - start_ns) / 1000000 ))
+  if [[ $(grep -Fc "Terminating background process" <<<"$cleanup_out") -eq 50 &&
+        $elapsed_ms -lt 2000 ]]; then
+    pass=$((pass+1))
+    log "PASS: exit_cleanup_bounded (${elapsed_ms} ms)"
+  else
+    fail=$((fail+1))
+    warn "FAIL: exit_cleanup_bounded (${elapsed_ms} ms)"
+  fi
+
+  # 8e) parallel keeps N commands running and summarizes their statuses
+  printf 'sleep 0.5\necho slow-done\n' > "$WORKDIR/par_slow.sh"
+  printf 'sh %s\necho fast-done\n' "$WORKDIR/par_slow.sh" > "$WORKDIR/par_order.txt"
+  test_case "parallel_concurrent" "" \
+    --arg -c --arg "parallel -j 2 $WORKDIR/par_order.txt" \
+    --before "fast-done" "slow-done" \
+    --expect "2 commands, 2 succeeded, 0 failed" \
+    --rc 0
+  test_case "parallel_bounded" "" \
+    --arg -c --arg "parallel -j 1 < $WORKDIR/par_order.txt" \
+    --before "slow-done" "fast-done"
+  printf 'true\nfalse\ncd /\necho ok\n' > "$WORKDIR/par_mixed.txt"
+  test_case "parallel_summary" "" \
+    --arg -c --arg "parallel -j 3 $WORKDIR/par_mixed.txt" \
+    --expect "line 2 (false): exit value 1" \
+    --expect "line 3: only simple external commands" \
+    --expect "4 commands, 2 succeeded, 1 failed, 1 not started" \
+    --rc 1
+
+  # 8e2) on / @group fan a command out over ssh (a local stand-in here)
+  cat > "$WORKDIR/fake_ssh" <<'FAKE'
+#!/bin/sh
+while [ $# -gt 0 ]; do
+  case "$1" in -o) shift 2 ;; -*) shift ;; *) break ;; esac
+done
+host=$1; shift; [ "$1" = "--" ] && shift
+case "$host" in
+  down*) echo "ssh: connect to host $host: Connection refused" >&2; exit 255 ;;
+esac
+exec sh -c "$*"
+FAKE
+  chmod +x "$WORKDIR/fake_ssh"
+  printf '# name hosts...\nweb w1 w2 w3\nmixed w1 down1\n' > "$WORKDIR/hosts"
+  test_case "fleet_on" \
+    $'on @web echo hello\nstatus\n@mixed echo hi\nstatus\non -j 1 a,b sleep 0\nexit\n' \
+    --env SMALLSH_SSH="$WORKDIR/fake_ssh" --env SMALLSH_HOSTS="$WORKDIR/hosts" \
+    --expect "w1: hello" \
+    --expect "w3: hello" \
+    --expect "on: 3 hosts, 3 succeeded, 0 failed" \
+    --expect "down1: ssh: connect to host down1" \
+    --expect "on: down1: exit value 255" \
+    --expect "hosts: 1 succeeded, 1 failed (down1 exit value 255)" \
+    --expect "on: 2 hosts, 2 succeeded, 0 failed" \
+    --count 1 "exit value 0" \
+    --count 1 "exit value 1"
+
+  # 8e3) limit sets rlimits for one command or the session, in the child
+  test_case "job_limits" \
+    $'limit -t 5 -n 37 cat /proc/self/limits\nlimit -t 1 yes > /dev/null\nstatus\nlimit -n 40\ncat /proc/self/limits\nlimit -r\nlimit\nlimit -m 5 true\nexit\n' \
+    --expect "Max cpu time              5                    6" \
+    --expect "Max open files            37                   37" \
+    --expect "Max open files            40                   40" \
+    --expect "terminated by signal 24" \
+    --expect "open files     unlimited" \
+    --expect "limit: -m needs a cgroup"
+  # Each controller is enabled on its own: cpu is listed already, memory
+  # is written by the second job (a plain directory stands in for the
+  # cgroup root, so the leaves' control files are missing)
+  rm -rf "$WORKDIR/cgroot" && mkdir -p "$WORKDIR/cgroot"
+  printf 'cpu\n' > "$WORKDIR/cgroot/cgroup.subtree_control"
+  test_case "job_cgroup_controllers" $'limit -c 50 true\nlimit -m 100 true\nexit\n' \
+    --env SMALLSH_CGROUP="$WORKDIR/cgroot" \
+    --expect "cpu.max: No such file" \
+    --expect "memory.max: No such file"
+  if [[ "$(cat "$WORKDIR/cgroot/cgroup.subtree_control")" == "+memory" ]]; then
+    pass=$((pass+1))
+    log "PASS: job_cgroup_subtree_control"
+  else
+    fail=$((fail+1))
+    warn "FAIL: job_cgroup_subtree_control"
+    log "subtree_control: $(cat "$WORKDIR/cgroot/cgroup.subtree_control")"
+  fi
+  test_case "job_limits_pipeline" \
+    $'limit -n 38 /bin/echo piped-a | cat\nlimit -n 39 /bin/echo x | cat /proc/self/limits\nlimit -n 5 | cat\nlimit\nexit\n' \
+    --expect "piped-a" \
+    --expect "Max open files            39                   39" \
+    --expect "limit: a pipeline needs a command" \
+    --expect "open files     unlimited" \
+    --absent "exec failed"
+
+  # 8e4) pin places background jobs round-robin and jobs shows where
+  test_case "job_placement" \
+    $'pin cpu\nsleep 0.5 &\nsleep 0.5 | sleep 0.5 &\npin node\nsleep 0.5 &\njobs\npin\npin none\npin 99999\nexit\n' \
+    --expect "sleep 0.5 [cpu " \
+    --count 1 "] | sleep 0.5 [cpu " \
+    --expect "sleep 0.5 [node " \
+    --expect "placement: node" \
+    --expect "usage: pin"
+  # pin covers every stage of a pipeline (on a CPU this shell may use)
+  local cpu
+  cpu=$(awk '/^Cpus_allowed_list/ { split($2, c, /[-,]/); print c[1] }' /proc/self/status)
+  test_case "job_placement_pipeline" \
+    "pin $cpu /bin/echo pinned-b | cat"$'\n'"pin $cpu grep Cpus_allowed_list /proc/self/status | cat"$'\n'"pin $cpu sleep 0.5 | sleep 0.5 &"$'\njobs\n'"pin $cpu | cat"$'\nexit\n' \
+    --expect "pinned-b" \
+    --expect $'Cpus_allowed_list:\t'"$cpu" \
+    --expect "sleep 0.5 [cpus $cpu] | sleep 0.5 [cpus $cpu]" \
+    --expect "pin: a pipeline needs a command" \
+    --absent "exec failed"
+
+  # 8e5) capture and $(...) read a command's output, builtins included
+  test_case "command_capture" \
+    $'capture X echo hi there\necho [$X]\necho sub $(echo a b) $(echo $(echo deep))\nfor f in $(echo x y); do echo item $f; done\ncapture Y ls /nonexistent-capture\nstatus\necho piped $(echo abc | tr a-c x-z)\ncapture Z echo too long for the cap\ncapture 1X true\necho $(head -c 3000 /dev/zero | tr "\\0" a)\nexit\n' \
+    --env SMALLSH_CAPTURE_MAX=16 \
+    --expect "[hi there]" \
+    --expect "sub a b deep" \
+    --expect "item x" \
+    --expect "item y" \
+    --expect "exit value 2" \
+    --expect "piped xyz" \
+    --expect "capture: output of echo is over 16 bytes" \
+    --expect "usage: capture" \
+    --expect "Command line too long after expansion"
+
+  # 8e6) wait returns a background job's status as soon as it ends
+  test_case "wait_builtin" \
+    $'sleep 0.2 | false &\nsleep 3 &\nwait %1\nstatus\nls /nonexistent-wait 2> /dev/null &\nwait -n\nstatus\nwait -t 0.1 %2\nstatus\nwait $$\nstatus\nwait -t x\nexit\n' \
+    --count 2 "exit value 2" \
+    --expect "exit value 1" \
+    --expect "exit value 124" \
+    --expect "is not a child of this shell" \
+    --expect "exit value 127" \
+    --expect "usage: wait"
+
+  # 8e7) stats counts launches, failures and reaps; the socket serves them
+  test_case "metrics_stats" \
+    $'ls / > /dev/null\nnosuchcmd-stats\nsleep 0.1 &\nwait\necho <\nstats\nexit\n' \
+    --expect "smallsh_commands_launched_total 2" \
+    --expect "smallsh_exec_failures_total 1" \
+    --expect "smallsh_zombies_reaped_total 2" \
+    --expect "smallsh_parse_errors_total 1" \
+    --expect "smallsh_background_jobs_active 0" \
+    --expect "smallsh_spawn_seconds_count 2" \
+    --expect 'smallsh_runtime_seconds_bucket{le="+Inf"} 2'
+  if command -v curl >/dev/null 2>&1; then
+    test_case "metrics_socket" \
+      $'sleep 0.1 &\nwait\ncurl -s --unix-socket '"$WORKDIR/metrics.sock"$' http://localhost/metrics\nexit\n' \
+      --env SMALLSH_METRICS_SOCKET="$WORKDIR/metrics.sock" \
+      --expect "smallsh_commands_launched_total 2" \
+      --expect "smallsh_runtime_seconds_count 1"
+    # A client that hangs up before the reply must not take the server down
+    if command -v python3 >/dev/null 2>&1; then
+      printf '%s\n' 'import socket, sys' 's = socket.socket(socket.AF_UNIX)' \
+        's.connect(sys.argv[1])' 's.sendall(b"GET / HTTP/1.0\r\n\r\n")' \
+        's.close()' > "$WORKDIR/hangup.py"
+      test_case "metrics_socket_hangup" \
+        $'python3 '"$WORKDIR/hangup.py $WORKDIR/metrics.sock"$'\nsleep 0.2\ncurl -s --unix-socket '"$WORKDIR/metrics.sock"$' http://localhost/metrics\nstatus\nexit\n' \
+        --env SMALLSH_METRICS_SOCKET="$WORKDIR/metrics.sock" \
+        --expect "smallsh_commands_launched_total 3" \
+        --expect "exit value 0"
+    fi
+  fi
+
+  # 8f) Ctrl-Z stops a foreground job under a pty; fg resumes it
+  if command -v script >/dev/null 2>&1; then
+    hr
+    log "TEST: job_control_pty"
+    local out
+    out=$({ sleep 0.5; printf 'sleep 5\n'; sleep 0.5; printf '\032'
+            sleep 0.5; printf 'jobs\n'; sleep 0.3; printf 'fg\n'
+            sleep 0.3; printf '\003'; sleep 0.3; printf 'status\nexit\n'
+            sleep 0.5; } | ${TIMEOUT_BIN:+"$TIMEOUT_BIN" "$TIME_LIMIT"} \
+          script -qec "$BIN" /dev/null 2>&1 | tr -d '\r' || true)
+    if grep -Fq "[1]+  Stopped" <<<"$out" &&
+       grep -Fq "[1]  Stopped" <<<"$out" &&
+       grep -Fq "terminated by signal 2" <<<"$out"; then
+      pass=$((pass+1))
+      log "PASS: job_control_pty"
+    else
+      fail=$((fail+1))
+      warn "FAIL: job_control_pty"
+      log "Output:\n$out"
+    fi
+  else
+    skipped=$((skipped+1))
+    warn "Skipping job_control_pty (script not available)."
+  fi
+
+  # 8f2) The line editor under a pty: Tab completes a builtin, Up recalls
+  # the last line and Ctrl-R finds it again
+  if command -v script >/dev/null 2>&1; then
+    hr
+    log "TEST: line_editor_pty"
+    local out
+    rm -f "$WORKDIR/editor_history"
+    out=$({ sleep 0.5; printf 'ech\tedited-line\r'; sleep 0.3
+            printf '\033[A\r'; sleep 0.3; printf 'true\r'; sleep 0.3
+            printf '\022edited\r'; sleep 0.3; printf '\004'; sleep 0.5; } |
+          TERM=xterm SMALLSH_HISTFILE="$WORKDIR/editor_history" \
+          ${TIMEOUT_BIN:+"$TIMEOUT_BIN" "$TIME_LIMIT"} \
+          script -qec "$BIN" /dev/null 2>&1 | tr -d '\r' || true)
+    if [[ $(grep -cx "edited-line" <<<"$out") -eq 3 ]] &&
+       grep -Fq "EOF detected" <<<"$out"; then
+      pass=$((pass+1))
+      log "PASS: line_editor_pty"
+    else
+      fail=$((fail+1))
+      warn "FAIL: line_editor_pty"
+      log "Output:\n$out"
+    fi
+  else
+    skipped=$((skipped+1))
+    warn "Skipping line_editor_pty (script not available)."
+  fi
+
+  # 8g) Built-in self tests (--test) report no failures
+  test_case "self_test" "" --arg --test \
+    --expect "PASS" \
+    --absent "FAIL" \
+    --rc 0
+
+  # 8h) Library build: two threads embed their own shells (smallsh.h)
+  hr
+  log "TEST: embed_library"
+  local embed_bin="$BUILD_DIR/embed_smallsh" embed_out
+  if cc -std=c99 -Wall -Wextra -O2 -pthread -DSMALLSH_LIBRARY \
+       -I"$(dirname "$src")" -o "$embed_bin" \
+       "$PROJECT_ROOT/tests/embed_smallsh.c" "$src" &&
+     embed_out=$(${TIMEOUT_BIN:+"$TIMEOUT_BIN" "$TIME_LIMIT"} "$embed_bin" 2>&1) &&
+     grep -Fq "embed: ok" <<<"$embed_out"; then
+    pass=$((pass+1))
+    log "PASS: embed_library"
+  else
+    fail=$((fail+1))
+    warn "FAIL: embed_library"
+    log "Output:\n${embed_out:-}"
+  fi
+
   # 9) SIGTSTP toggles foreground-only mode (best-effort)
   # Many reference implementations print these exact messages.
   if [[ -t 0 ]]; then